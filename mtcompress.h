@@ -0,0 +1,149 @@
+/*
+mtcompress.h
+
+Library interface of MultithreadedCompressor.cpp. The same source builds
+the mtcompress tool and, with -DMTC_LIBRARY, a static or shared library
+without main() or the command-line modes (see Build there). Link the
+library with zlib (plus zstd/lz4 when compiled in) and -pthread.
+
+A Pool owns the worker threads, and each worker keeps its codec contexts
+for the pool's lifetime, so a long-running process creates one Pool and
+reuses it for every call instead of paying thread and context setup per
+request. Calls on one Pool may run concurrently from any number of
+threads, but not from inside a task running on that Pool.
+
+The *_async calls return at once with a future and never block the
+calling thread on the pool: the blocks are queued as pool tasks, and the
+one that finishes last completes the call on its worker (an event loop can
+poll the future, or post back to itself from on_done, e.g. to resume a
+coroutine). High-priority calls' blocks go ahead of every ordinary block
+still queued, so small latency-sensitive requests do not wait behind a
+bulk job; a block that is already running is never interrupted. Cancelling
+skips the blocks that have not started, and the call completes Cancelled
+with out left as it was.
+
+Status output of the file functions is suppressed; errors are reported
+through the return value (and a line on stderr). Archives written here
+are ordinary .mtcz files, readable by the tool and vice versa.
+*/
+#ifndef MTCOMPRESS_H
+#define MTCOMPRESS_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+#if defined(__GNUC__)
+#define MTC_API __attribute__((visibility("default")))
+#else
+#define MTC_API
+#endif
+
+namespace mtc {
+
+enum class Codec : uint16_t { Zlib = 0, Zstd = 1, Lz4 = 2 };
+
+// Block filters for arrays of 2-, 4- or 8-byte numbers, like -e
+enum class Filter : uint8_t {
+    None = 0,
+    Shuffle2 = 0x11, Shuffle4 = 0x12, Shuffle8 = 0x13, // byte planes
+    Delta2 = 0x21, Delta4 = 0x22, Delta8 = 0x23,       // integer differences, then planes
+    Xor2 = 0x31, Xor4 = 0x32, Xor8 = 0x33,             // XOR with the previous value, then planes
+};
+
+struct CompressOptions {
+    Codec codec = Codec::Zlib;
+    int level = -1;                     // codec level; -1 = the codec's default
+    uint64_t block_size = 1024 * 1024;  // original bytes per block (at least 4 KiB); 0 = auto, like -b auto
+    uint32_t chain = 1;                 // blocks per dictionary chain (1 = independent blocks)
+    Filter filter = Filter::None;
+};
+
+enum class Priority { Normal, High };
+
+enum class Status { Ok, Cancelled, Failed };
+
+// Cancellation flag shared by its copies
+class CancelToken {
+public:
+    CancelToken() : flag_(std::make_shared<std::atomic<bool>>(false)) {}
+    void cancel() { *flag_ = true; }
+    bool cancelled() const { return *flag_; }
+    std::shared_ptr<std::atomic<bool>> flag() const { return flag_; }
+
+private:
+    std::shared_ptr<std::atomic<bool>> flag_;
+};
+
+struct AsyncOptions {
+    Priority priority = Priority::Normal;
+    CancelToken cancel;
+    std::function<void(Status)> on_done; // on the worker completing the call, just before the future is ready
+};
+
+// Worker threads shared by any number of calls
+class MTC_API Pool {
+public:
+    explicit Pool(int threads = 0); // 0 = one per core
+    ~Pool();
+    Pool(const Pool&) = delete;
+    Pool &operator=(const Pool&) = delete;
+
+    int size() const;
+
+    struct Impl;
+    Impl &impl() { return *impl_; }
+
+private:
+    std::unique_ptr<Impl> impl_;
+};
+
+// Whether the codec was compiled into this build
+MTC_API bool codec_available(Codec codec);
+
+// Files, like modes c and d (a directory input makes a directory archive,
+// which decompress_file unpacks into the output directory). These run on
+// threads of their own.
+MTC_API bool compress_file(const std::string &input, const std::string &output, int threads,
+                           const CompressOptions &opts = CompressOptions());
+MTC_API bool decompress_file(const std::string &input, const std::string &output, int threads);
+// Like mode a: compress only what input gained since archive was written
+// (creating it if missing); the codec, level and chain stay the archive's
+MTC_API bool append_file(const std::string &input, const std::string &archive, int threads,
+                         const CompressOptions &opts = CompressOptions());
+
+// Decode bytes [offset, offset + length) of an archive file's original data
+// and append them to out (clipped to the end of the data), like mode x.
+// archive may be an http:// URL, read with Range requests.
+MTC_API bool read_range(const std::string &archive, uint64_t offset, uint64_t length,
+                        std::vector<unsigned char> &out, Pool &pool);
+
+// In memory. compress_buffer appends a complete archive for src[0, size)
+// to out; decompressed_size reads the original size from an archive's
+// index; decompress_buffer restores an archive into dst, which must hold
+// at least decompressed_size() bytes, or appends it to out.
+MTC_API bool compress_buffer(const void *src, size_t size, std::vector<unsigned char> &out, Pool &pool,
+                             const CompressOptions &opts = CompressOptions());
+MTC_API bool decompressed_size(const void *archive, size_t size, uint64_t &original_size);
+MTC_API bool decompress_buffer(const void *archive, size_t size, void *dst, size_t dst_size, Pool &pool);
+MTC_API bool decompress_buffer(const void *archive, size_t size, std::vector<unsigned char> &out, Pool &pool);
+
+// Asynchronous versions of the above. src/archive and the destination must
+// stay valid until the call completes. An input with nothing to encode or
+// decode, or one rejected up front, completes in the calling thread.
+MTC_API std::future<Status> compress_buffer_async(const void *src, size_t size, std::vector<unsigned char> &out,
+                                                  Pool &pool, const CompressOptions &opts = CompressOptions(),
+                                                  const AsyncOptions &async = AsyncOptions());
+MTC_API std::future<Status> decompress_buffer_async(const void *archive, size_t size, void *dst, size_t dst_size,
+                                                    Pool &pool, const AsyncOptions &async = AsyncOptions());
+MTC_API std::future<Status> decompress_buffer_async(const void *archive, size_t size, std::vector<unsigned char> &out,
+                                                    Pool &pool, const AsyncOptions &async = AsyncOptions());
+
+} // namespace mtc
+
+#endif